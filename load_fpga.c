@@ -5,25 +5,77 @@
 #include "linux/spi/spi.h"
 #include "linux/firmware.h"
 #include <linux/platform_device.h>
+#include <linux/of.h>
 #include <linux/ipu-v3.h>
 #include <linux/dma-mapping.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/crc32.h>
 
-#define ERROR_NO_INIT_OK        10001
-#define ERROR_NO_CONFIG_DONE    10002
 #define ERROR_NO_SETUP          10003
 #define ERROR_NO_SPI            10004
+#define ERROR_BAD_CRC           10005
 #define FW_DIR "FLIR/"
 #define FW_FILE "yildun.bin"
 #define DMA_CHUNK_SIZE PAGE_SIZE // At least 64 bytes for the SPI
+#define DMA_CHUNK_MIN 64
+#define DMA_CHUNK_MAX (64 * 1024)
 
 static const struct firmware *pFW;
 
+struct spi_board_info chip = {
+	.modalias = "yildunspi",
+	.max_speed_hz = 50000000,
+	.mode = SPI_MODE_0,
+};
+
 static inline void msleep_range(unsigned long min, unsigned long max)
 {
 	usleep_range(min * 1000, max * 1000);
 }
 
+// Store time spent in a load phase and restart the phase clock
+static inline void phase_done(PFVD_DEV_INFO pDev, enum yildun_phase phase, ktime_t *start)
+{
+	ktime_t now = ktime_get();
+
+	pDev->phase_ns[phase] = ktime_to_ns(ktime_sub(now, *start));
+	*start = now;
+}
+
+// Largest number of bytes to send before yielding the SPI bus, 0 = unbounded
+static unsigned long get_burst_size(PFVD_DEV_INFO pDev, u32 hz)
+{
+	unsigned long burst = pDev->spi_burst_bytes;
+
+	if (pDev->spi_burst_us) {
+		unsigned long bytes;
+
+		bytes = div_u64((u64)hz * pDev->spi_burst_us, 8 * USEC_PER_SEC);
+		// A short limit at a slow clock must not round down to unbounded
+		bytes = max_t(unsigned long, bytes, DMA_CHUNK_MIN);
+		if (!burst || bytes < burst)
+			burst = bytes;
+	}
+
+	return burst;
+}
+
+static unsigned long get_chunk_size(PFVD_DEV_INFO pDev, unsigned long burst)
+{
+	unsigned long size = pDev->chunk_size;
+
+	if (!size)
+		size = DMA_CHUNK_SIZE;
+
+	// A chunk is never split, so it must fit in a burst
+	if (burst && burst < size)
+		size = burst;
+
+	// Whole 32-bit words only, bursts below DMA_CHUNK_MIN are raised to it
+	size = clamp_t(unsigned long, size, DMA_CHUNK_MIN, DMA_CHUNK_MAX);
+	return size & ~3UL;
+}
 
 PUCHAR get_fpga_data(PFVD_DEV_INFO pDev, ULONG *size, char *pHeader)
 {
@@ -64,6 +116,45 @@ PUCHAR get_fpga_data(PFVD_DEV_INFO pDev, ULONG *size, char *pHeader)
 	return ((PUCHAR) &pFW->data[sizeof(GENERIC_FPGA_T) + pGen->spec_size]);
 }
 
+/**
+ * get_fpga_crc
+ *
+ * Read the expected CRC32 of the bitstream from FW_FILE ".crc", installed
+ * next to the bitstream by the same package. It holds the CRC32 of the
+ * payload after the headers, as hex text.
+ *
+ * @param pDev
+ * @param crc
+ *
+ * @return 1 when crc was read
+ *      0 when there is no CRC file
+ *      negative when the CRC file is invalid
+ */
+static int get_fpga_crc(PFVD_DEV_INFO pDev, u32 *crc)
+{
+	const struct firmware *fw;
+	char filename[] = FW_DIR FW_FILE ".crc";
+	char str[16];
+	size_t len;
+	int retval;
+
+	// Optional, so no usermode helper fallback and no warning
+	if (request_firmware_direct(&fw, filename, pDev->dev))
+		return 0;
+
+	len = min(fw->size, sizeof(str) - 1);
+	memcpy(str, fw->data, len);
+	str[len] = '\0';
+	release_firmware(fw);
+
+	retval = kstrtou32(strim(str), 16, crc);
+	if (retval) {
+		dev_err(pDev->dev, "Invalid CRC in %s\n", filename);
+		return retval;
+	}
+	return 1;
+}
+
 void free_fpga_data(PFVD_DEV_INFO pDev)
 {
 	if (pFW) {
@@ -75,21 +166,10 @@ void free_fpga_data(PFVD_DEV_INFO pDev)
 
 int CheckFPGA(PFVD_DEV_INFO pDev)
 {
-	if (pDev->pGetPinDone(pDev))
-		return 0;
-
-	if (pDev->pGetPinStatus(pDev))
-		return -ERROR_NO_CONFIG_DONE;
-
-	return -ERROR_NO_INIT_OK;
+	// Specialized per backend, which reads the pins directly
+	return pDev->pCheckFPGA(pDev);
 }
 
-struct spi_board_info chip = {
-	.modalias = "yildunspi",
-	.max_speed_hz = 50000000,
-	.mode = SPI_MODE_0,
-};
-
 static inline u32 reverse_bits(u32 data)
 {
 #ifdef __arm__
@@ -119,8 +199,12 @@ static inline u32 reverse_bits(u32 data)
 #endif
 }
 
-static void fill_dma_buf(unsigned long *iptr, unsigned long *optr, unsigned long len, bool lsb_first)
+// Transform one chunk and return the CRC32 of the input continued from crc
+static u32 fill_dma_buf(unsigned long *iptr, unsigned long *optr, unsigned long len, bool lsb_first, u32 crc)
 {
+	// Checksum the chunk while it is being pulled into the cache
+	crc = crc32_le(crc, (unsigned char *)iptr, len * 4);
+
 	// swap bit and byte order
 	if (lsb_first) {
 		while (len--)
@@ -133,29 +217,117 @@ static void fill_dma_buf(unsigned long *iptr, unsigned long *optr, unsigned long
 			    ((tmp << 8) & 0xFF0000) | (tmp << 24);
 		}
 	}
+
+	return crc;
 }
 
-static int spi_configure(PFVD_DEV_INFO pDev, struct spi_master **master, struct spi_device **device)
+/**
+ * fpga_spi_setup
+ *
+ * Create the SPI device used for loading the FPGA. Called once at probe,
+ * the device is kept until fpga_spi_release(). Bus, chip select and clock
+ * are taken from an optional "spi" child node, e.g.
+ *
+ *	spi {
+ *		bus-num = <1>;
+ *		reg = <0>;
+ *		spi-max-frequency = <50000000>;
+ *	};
+ *
+ * and otherwise from iSpiBus and the defaults in chip.
+ *
+ * @param pDev
+ *
+ * @return 0 on success
+ *      -EPROBE_DEFER if the SPI master is not registered yet
+ *      negative on other errors
+ */
+int fpga_spi_setup(PFVD_DEV_INFO pDev)
 {
-	*master = spi_busnum_to_master(pDev->iSpiBus);
-	if (*master == NULL) {
-		dev_err(pDev->dev, "%s: Failed to get SPI master\n", __func__);
-		return -ERROR_NO_SPI;
+	struct spi_board_info info = chip;
+	struct device_node *np;
+	u32 val;
+	int retval;
+
+	// Backend sends the bitstream itself
+	if (pDev->pWriteData)
+		return 0;
+
+	np = of_get_child_by_name(pDev->dev->of_node, "spi");
+	if (np) {
+		if (!of_property_read_u32(np, "bus-num", &val))
+			pDev->iSpiBus = val;
+		if (!of_property_read_u32(np, "reg", &val))
+			info.chip_select = val;
+		if (!of_property_read_u32(np, "spi-max-frequency", &val))
+			info.max_speed_hz = val;
+		of_node_put(np);
+	}
+
+	pDev->spi_master = spi_busnum_to_master(pDev->iSpiBus);
+	if (pDev->spi_master == NULL) {
+		dev_dbg(pDev->dev, "%s: SPI master %d not available yet\n", __func__, pDev->iSpiBus);
+		return -EPROBE_DEFER;
 	}
-	*device = spi_new_device(*master, &chip);
-	if (*device == NULL) {
+
+	pDev->spi_device = spi_new_device(pDev->spi_master, &info);
+	if (pDev->spi_device == NULL) {
 		dev_err(pDev->dev, "%s: Failed to set SPI device\n", __func__);
-		return -ERROR_NO_SPI;
+		retval = -ERROR_NO_SPI;
+		goto ERROR;
 	}
 
-	(*device)->bits_per_word = 32;
-	return spi_setup(*device);
+	pDev->spi_device->bits_per_word = 32;
+	retval = spi_setup(pDev->spi_device);
+	if (retval) {
+		dev_err(pDev->dev, "%s: SPI setup failed (%d)\n", __func__, retval);
+		device_unregister(&pDev->spi_device->dev);
+		goto ERROR;
+	}
+
+	return 0;
+
+ERROR:
+	pDev->spi_device = NULL;
+	put_device(&pDev->spi_master->dev);
+	pDev->spi_master = NULL;
+	return retval;
+}
+
+void fpga_spi_release(PFVD_DEV_INFO pDev)
+{
+	if (pDev->spi_device)
+		device_unregister(&pDev->spi_device->dev);
+	if (pDev->spi_master)
+		put_device(&pDev->spi_master->dev);
+	pDev->spi_device = NULL;
+	pDev->spi_master = NULL;
 }
 
-static void spi_release(struct spi_master *master, struct spi_device *device)
+static int fpga_spi_write(PFVD_DEV_INFO pDev, const void *buf, size_t len, u32 hz, bool bus_locked)
 {
-	device_unregister(&device->dev);
-	put_device(&master->dev);
+	struct spi_transfer t = {
+		.tx_buf = buf,
+		.len = len,
+		.speed_hz = hz,
+	};
+	struct spi_message m;
+
+	if (pDev->pWriteData)
+		return pDev->pWriteData(pDev, buf, len);
+
+	spi_message_init_with_transfers(&m, &t, 1);
+	if (bus_locked)
+		return spi_sync_locked(pDev->spi_device, &m);
+	return spi_sync(pDev->spi_device, &m);
+}
+
+static inline void chunk_latency_done(PFVD_DEV_INFO pDev, ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (ns > pDev->spi_max_latency_ns)
+		pDev->spi_max_latency_ns = ns;
 }
 
 static int fpga_set_programming_mode(PFVD_DEV_INFO pDev)
@@ -168,6 +340,8 @@ static int fpga_set_programming_mode(PFVD_DEV_INFO pDev)
 
 	retval = pDev->pPutInProgrammingMode(pDev);
 	if (retval == 0) {
+		if (!pDev->benchmark)
+			atomic_long_inc(&pDev->stats.prog_mode_retries);
 		msleep_range(10, 20);
 		if (pDev->pPutInProgrammingMode(pDev) == 0) {
 			dev_err(pDev->dev, "%s: Failed to set FPGA in programming mode\n", __func__);
@@ -182,9 +356,130 @@ static int fpga_set_programming_mode(PFVD_DEV_INFO pDev)
 	return 0;
 }
 
+/**
+ * fpga_stream
+ *
+ * Send the bitstream to the FPGA. Other devices on the SPI bus get their
+ * messages in between chunks, unless spi_bus_exclusive is set, in which
+ * case the bus is locked for up to spi_burst_bytes/spi_burst_us at a time
+ * (the whole stream if unbounded).
+ *
+ * spi_max_latency_ns is raised to the longest time from submitting a chunk
+ * (or locking the bus for a burst) until it completed. It includes time
+ * queued behind other devices' messages, so it is an upper bound on how
+ * long the bus was held by the FPGA load, not an exact measure.
+ *
+ * The CRC32 of the whole bitstream, isize bytes, is left in image_crc.
+ *
+ * @param pDev
+ * @param iptr      bitstream
+ * @param isize     bitstream size in bytes
+ * @param buf       DMA buffer of at least max_chunk bytes
+ * @param max_chunk
+ * @param lsb_first
+ * @param hz        SPI clock
+ *
+ * @return 0 on success
+ *      negative on SPI error
+ */
+static int fpga_stream(PFVD_DEV_INFO pDev, unsigned long *iptr, unsigned long isize,
+		       ULONG *buf, unsigned long max_chunk, bool lsb_first, u32 hz)
+{
+	unsigned long chunks, tailbytes, chunk_size, burst, held = 0;
+	bool exclusive = pDev->spi_bus_exclusive && pDev->spi_master;
+	bool bus_locked = false;
+	ktime_t submitted = 0;
+	u32 crc = ~0;
+	int retval = 0;
+
+	burst = get_burst_size(pDev, hz);
+	chunk_size = min(get_chunk_size(pDev, burst), max_chunk);
+
+	chunks = isize / chunk_size;
+	tailbytes = isize - chunk_size * chunks;
+	if (tailbytes)
+		chunks++;
+	dev_dbg(pDev->dev, "Upload %lu chunks, with %lu trailing bytes at %u Hz\n", chunks, tailbytes, hz);
+
+	while (chunks--) {
+		unsigned long len = chunk_size / 4;
+
+		if (!chunks && tailbytes)
+			len = tailbytes / 4;
+		crc = fill_dma_buf(iptr, buf, len, lsb_first, crc);
+
+		if (exclusive && !bus_locked) {
+			spi_bus_lock(pDev->spi_master);
+			bus_locked = true;
+			held = 0;
+			submitted = ktime_get();
+		} else if (!exclusive) {
+			submitted = ktime_get();
+		}
+
+		retval = fpga_spi_write(pDev, buf, len * 4 / pDev->iSpiCountDivisor, hz, bus_locked);
+		iptr += len;
+		held += len * 4;
+
+		if (!bus_locked) {
+			chunk_latency_done(pDev, submitted);
+		} else if (retval || !chunks || (burst && held + chunk_size > burst)) {
+			spi_bus_unlock(pDev->spi_master);
+			bus_locked = false;
+			chunk_latency_done(pDev, submitted);
+			cond_resched();
+		}
+
+		if (retval) {
+			dev_err(pDev->dev, "%s: SPI write failed (%d), %lu chunks left\n", __func__, retval, chunks);
+			return retval;
+		}
+	}
+
+	// Bytes after the last whole word are not sent, but are part of the image
+	crc = crc32_le(crc, (unsigned char *)iptr, isize & 3);
+	pDev->image_crc = crc ^ ~0;
+	return 0;
+}
+
+static void count_result(PFVD_DEV_INFO pDev, int retval, bool spi_failed)
+{
+	struct yildun_stats *st = &pDev->stats;
+
+	if (pDev->benchmark)
+		return;
+
+	atomic_long_inc(&st->loads);
+	if (pDev->load_attempts > 1)
+		atomic_long_add(pDev->load_attempts - 1, &st->retries);
+
+	switch (retval) {
+	case 0:
+		atomic_long_inc(&st->load_ok);
+		break;
+	case -ERROR_NO_INIT_OK:
+		atomic_long_inc(&st->fail_init_ok);
+		break;
+	case -ERROR_NO_CONFIG_DONE:
+		atomic_long_inc(&st->fail_config_done);
+		break;
+	default:
+		// SPI write errors are plain errnos
+		if (spi_failed)
+			atomic_long_inc(&st->fail_spi);
+		else
+			atomic_long_inc(&st->fail_other);
+		break;
+	}
+}
+
 /**
  * LoadFPGA
  *
+ * Load the bitstream, retrying up to load_retries times at half the SPI
+ * clock of the previous attempt. If FW_FILE ".crc" is installed, the
+ * bitstream must match it.
+ *
  * @param pDev
  *
  * @return 0 on success
@@ -193,15 +488,31 @@ static int fpga_set_programming_mode(PFVD_DEV_INFO pDev)
 int LoadFPGA(PFVD_DEV_INFO pDev)
 {
 	int retval = 0;
-	unsigned long isize, chunks, tailbytes;
+	unsigned long isize, chunk_size;
 	unsigned char *fpgaBin;
-	unsigned long *iptr;
-	struct spi_master *pspim;
-	struct spi_device *pspid;
 	char fpgaheader[400];
 	bool lsb_first;
 	ULONG *buf = 0;
 	dma_addr_t phy;
+	unsigned int attempt;
+	u32 hz, crc_expected;
+	int check_crc;
+	bool spi_failed = false;
+	ktime_t t = ktime_get();
+
+	// The SPI pins are muxed as GPIO while the FPGA is powered down
+	if ((!pDev->spi_device && !pDev->pWriteData) || !pDev->spi_pins_active) {
+		dev_err(pDev->dev, "%s: SPI not available\n", __func__);
+		// Never reached the FPGA, not counted as a load
+		return -ERROR_NO_SPI;
+	}
+	hz = pDev->spi_speed_hz;
+	if (!hz && pDev->spi_device)
+		hz = pDev->spi_device->max_speed_hz;
+	if (!hz)
+		hz = chip.max_speed_hz;
+	chunk_size = get_chunk_size(pDev, get_burst_size(pDev, hz));
+	pDev->load_attempts = 0;
 
 	// read file
 	fpgaBin = get_fpga_data(pDev, &isize, fpgaheader);
@@ -211,51 +522,66 @@ int LoadFPGA(PFVD_DEV_INFO pDev)
 		goto ERROR;
 	}
 	lsb_first = ((GENERIC_FPGA_T *)(fpgaheader))->LSBfirst;
-	iptr = (unsigned long *)fpgaBin;
+	if (pDev->transform != YILDUN_TRANSFORM_AUTO)
+		lsb_first = (pDev->transform == YILDUN_TRANSFORM_BITREVERSE);
 
-	buf = dma_alloc_coherent(pDev->dev, DMA_CHUNK_SIZE, &phy, GFP_DMA | GFP_KERNEL);
-	if (!buf) {
-		retval = -ENOMEM;
+	check_crc = get_fpga_crc(pDev, &crc_expected);
+	if (check_crc < 0) {
+		retval = -ERROR_BAD_CRC;
 		goto ERROR;
 	}
 
-	retval = fpga_set_programming_mode(pDev);
-	if (retval)
-		goto ERROR;
-
-	retval = spi_configure(pDev, &pspim, &pspid);
-	if (retval)
+	buf = dma_alloc_coherent(pDev->dev, chunk_size, &phy, GFP_DMA | GFP_KERNEL);
+	if (!buf) {
+		retval = -ENOMEM;
 		goto ERROR;
-
-	chunks = isize / DMA_CHUNK_SIZE;
-	tailbytes = isize - DMA_CHUNK_SIZE * chunks;
-	if (tailbytes)
-		chunks++;
-	dev_dbg(pDev->dev, "Upload %lu chunks, with %lu trailing bytes\n", chunks, tailbytes);
-
-	while (chunks--) {
-		unsigned long len = DMA_CHUNK_SIZE / 4;
-
-		if (!chunks && tailbytes)
-			len = tailbytes / 4;
-		fill_dma_buf(iptr, buf, len, lsb_first);
-		retval = spi_write(pspid, buf, len * 4 / pDev->iSpiCountDivisor);
-		iptr += len;
 	}
+	phase_done(pDev, YILDUN_PHASE_FIRMWARE, &t);
+
+	// Worst case over all attempts of this load
+	pDev->spi_max_latency_ns = 0;
+	for (attempt = 0; attempt <= pDev->load_retries && hz; attempt++, hz /= 2) {
+		if (attempt)
+			dev_warn(pDev->dev, "FPGA Load failed (%d), retry at %u Hz\n", retval, hz);
+		pDev->load_attempts++;
+		spi_failed = false;
+
+		retval = fpga_set_programming_mode(pDev);
+		if (retval)
+			continue;
+		phase_done(pDev, YILDUN_PHASE_PROG_MODE, &t);
+
+		retval = fpga_stream(pDev, (unsigned long *)fpgaBin, isize, buf, chunk_size, lsb_first, hz);
+		phase_done(pDev, YILDUN_PHASE_STREAM, &t);
+		spi_failed = (retval != 0);
+		if (retval)
+			continue;
+
+		// A corrupt image will not load any better at a lower speed
+		if (check_crc && pDev->image_crc != crc_expected) {
+			dev_err(pDev->dev, "FPGA image CRC %08x, expected %08x\n",
+				pDev->image_crc, crc_expected);
+			retval = -ERROR_BAD_CRC;
+			goto ERROR;
+		}
 
-	spi_release(pspim, pspid);
+		retval = CheckFPGA(pDev);
+		phase_done(pDev, YILDUN_PHASE_CHECK, &t);
+		if (retval == -ERROR_SUCCESS)
+			break;
+	}
 
-	if (CheckFPGA(pDev) != -ERROR_SUCCESS) {
-		retval = -1;
-		dev_err(pDev->dev, "FPGA Load failed\n");
+	if (retval) {
+		dev_err(pDev->dev, "FPGA Load failed (%d)\n", retval);
 		goto ERROR;
 	}
 	dev_dbg(pDev->dev, "FPGA Load ok\n");
 
-	retval = 0;
 ERROR:
+	count_result(pDev, retval, spi_failed);
 	dev_dbg(pDev->dev, "Releasing coherent buffer\n");
-	dma_free_coherent(pDev->dev, DMA_CHUNK_SIZE, buf, phy);
+	if (buf)
+		dma_free_coherent(pDev->dev, chunk_size, buf, phy);
 	free_fpga_data(pDev);
 	return retval;
 }
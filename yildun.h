@@ -7,10 +7,28 @@
 
 // Function prototypes to set up hardware specific items
 int SetupMX6S(PFVD_DEV_INFO pDev);
+int SetupGpiod(PFVD_DEV_INFO pDev);
+int SetupSim(PFVD_DEV_INFO pDev);
+
+// Hardware backend, selected by the DT compatible string
+struct yildun_backend {
+	const char *name;
+	int (*setup)(PFVD_DEV_INFO pDev);
+};
 
 // Function prototypes for common FVD functions
 int LoadFPGA(PFVD_DEV_INFO pDev);
+int fpga_spi_setup(PFVD_DEV_INFO pDev);
+void fpga_spi_release(PFVD_DEV_INFO pDev);
 PUCHAR get_fpga_data(PFVD_DEV_INFO pDev, ULONG *size, char *out_revision);
 void free_fpga_data(PFVD_DEV_INFO pDev);
 
+// Enable/disable, caller holds data->lock
+int yildun_enable(struct yildun_data *data);
+void yildun_disable(struct yildun_data *data);
+
+// Debugfs load benchmark
+int yildun_bench_init(struct yildun_data *data);
+void yildun_bench_exit(struct yildun_data *data);
+
 #endif
@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ * Description of file:
+ *	Yildun load stress test and benchmark, controlled from debugfs
+ *
+ *	/sys/kernel/debug/yildun/
+ *	  chunk_size    SPI chunk size in bytes, 0 = driver default
+ *	  spi_speed_hz  SPI clock, 0 = driver default
+ *	  transform     0 = from FPGA header, 1 = byteswap, 2 = bitreverse
+ *	  run           write N to run N enable/disable cycles
+ *	  results       statistics from the latest run
+ *
+ *	Benchmark cycles are not counted in the sysfs stats/ counters and are
+ *	not published in the status page.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "yildun.h"
+#include "yildun_internal.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+
+#define YILDUN_BENCH_MAX_CYCLES 10000
+
+// Result rows, the load phases followed by the totals
+#define BENCH_ROW_ENABLE	YILDUN_PHASE_NUM
+#define BENCH_ROW_DISABLE	(YILDUN_PHASE_NUM + 1)
+#define BENCH_ROW_CHUNK_LAT	(YILDUN_PHASE_NUM + 2)
+#define BENCH_ROWS		(YILDUN_PHASE_NUM + 3)
+
+enum bench_pct {
+	BENCH_P50,
+	BENCH_P95,
+	BENCH_P99,
+	BENCH_MAX,
+	BENCH_PCTS,
+};
+
+static const unsigned int bench_pct_value[BENCH_PCTS] = { 50, 95, 99, 100 };
+
+static const char * const bench_row_name[BENCH_ROWS] = {
+	[YILDUN_PHASE_POWER_UP] = "power_up",
+	[YILDUN_PHASE_FIRMWARE] = "firmware",
+	[YILDUN_PHASE_PROG_MODE] = "prog_mode",
+	[YILDUN_PHASE_STREAM] = "stream",
+	[YILDUN_PHASE_CHECK] = "check",
+	[BENCH_ROW_ENABLE] = "enable",
+	[BENCH_ROW_DISABLE] = "disable",
+	[BENCH_ROW_CHUNK_LAT] = "chunk_lat",
+};
+
+struct yildun_bench {
+	struct dentry *dir;
+
+	// Parameters for the next run
+	u32 chunk_size;
+	u32 spi_speed_hz;
+	u32 transform;
+
+	// Results of the latest run
+	u32 cycles;
+	u32 ok;
+	u32 failed;
+	int last_error;
+	u64 ns[BENCH_ROWS][BENCH_PCTS];
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_percentiles(struct yildun_bench *b, u64 *samples, unsigned int stride, unsigned int n)
+{
+	int row, pct;
+
+	for (row = 0; row < BENCH_ROWS; row++) {
+		u64 *s = &samples[row * stride];
+
+		sort(s, n, sizeof(*s), cmp_u64, NULL);
+		for (pct = 0; pct < BENCH_PCTS; pct++) {
+			// Nearest rank
+			unsigned int idx = DIV_ROUND_UP(n * bench_pct_value[pct], 100);
+
+			b->ns[row][pct] = s[idx ? idx - 1 : 0];
+		}
+	}
+}
+
+static int bench_run(struct yildun_data *data, unsigned int cycles)
+{
+	struct yildun_bench *b = data->bench;
+	PFVD_DEV_INFO pDev = &data->yildundev;
+	unsigned int chunk_size;
+	u32 spi_speed_hz;
+	enum yildun_transform transform;
+	unsigned int i, n = 0;
+	u64 *samples;
+	int row, ret;
+
+	if (!cycles || cycles > YILDUN_BENCH_MAX_CYCLES)
+		return -EINVAL;
+	if (b->transform > YILDUN_TRANSFORM_BITREVERSE)
+		return -EINVAL;
+
+	samples = kvmalloc_array(BENCH_ROWS * cycles, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	ret = mutex_lock_interruptible(&data->lock);
+	if (ret)
+		goto OUT;
+
+	// Do not pull the FPGA away from a running application
+	if (data->enabled || pDev->benchmark) {
+		mutex_unlock(&data->lock);
+		ret = -EBUSY;
+		goto OUT;
+	}
+
+	b->cycles = 0;
+	b->ok = 0;
+	b->failed = 0;
+	b->last_error = 0;
+	memset(b->ns, 0, sizeof(b->ns));
+
+	chunk_size = pDev->chunk_size;
+	spi_speed_hz = pDev->spi_speed_hz;
+	transform = pDev->transform;
+	pDev->chunk_size = b->chunk_size;
+	pDev->spi_speed_hz = b->spi_speed_hz;
+	pDev->transform = b->transform;
+	pDev->benchmark = true;
+	mutex_unlock(&data->lock);
+
+	// The lock is only held for one cycle at a time, so sysfs and the
+	// results file stay responsive. Enable ioctls get -EBUSY meanwhile.
+	for (i = 0; i < cycles; i++) {
+		ktime_t t;
+		u64 enable_ns;
+
+		mutex_lock(&data->lock);
+		t = ktime_get();
+		ret = yildun_enable(data);
+		enable_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+		if (ret) {
+			b->failed++;
+			b->last_error = ret;
+		} else {
+			b->ok++;
+			for (row = 0; row < YILDUN_PHASE_NUM; row++)
+				samples[row * cycles + n] = pDev->phase_ns[row];
+			samples[BENCH_ROW_ENABLE * cycles + n] = enable_ns;
+			samples[BENCH_ROW_CHUNK_LAT * cycles + n] = pDev->spi_max_latency_ns;
+
+			t = ktime_get();
+			yildun_disable(data);
+			samples[BENCH_ROW_DISABLE * cycles + n] = ktime_to_ns(ktime_sub(ktime_get(), t));
+			n++;
+		}
+		b->cycles++;
+		mutex_unlock(&data->lock);
+
+		if (signal_pending(current))
+			break;
+		cond_resched();
+	}
+	ret = 0;
+
+	mutex_lock(&data->lock);
+	pDev->benchmark = false;
+	pDev->chunk_size = chunk_size;
+	pDev->spi_speed_hz = spi_speed_hz;
+	pDev->transform = transform;
+
+	if (n)
+		bench_percentiles(b, samples, cycles, n);
+
+	dev_info(data->dev, "Benchmark: %u cycles, %u ok, %u failed\n", b->cycles, b->ok, b->failed);
+	mutex_unlock(&data->lock);
+OUT:
+	kvfree(samples);
+	return ret;
+}
+
+static ssize_t bench_run_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+	struct yildun_data *data = file->private_data;
+	unsigned int cycles;
+	int ret;
+
+	ret = kstrtouint_from_user(ubuf, count, 0, &cycles);
+	if (ret)
+		return ret;
+
+	ret = bench_run(data, cycles);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static const struct file_operations bench_run_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = bench_run_write,
+	.llseek = no_llseek,
+};
+
+static int bench_results_show(struct seq_file *s, void *unused)
+{
+	struct yildun_data *data = s->private;
+	struct yildun_bench *b = data->bench;
+	int row, pct;
+
+	mutex_lock(&data->lock);
+
+	seq_printf(s, "cycles: %u\nok: %u\nfailed: %u\nlast_error: %d\n",
+		   b->cycles, b->ok, b->failed, b->last_error);
+	seq_printf(s, "%-10s %10s %10s %10s %10s\n", "phase", "p50_us", "p95_us", "p99_us", "max_us");
+	for (row = 0; row < BENCH_ROWS; row++) {
+		seq_printf(s, "%-10s", bench_row_name[row]);
+		for (pct = 0; pct < BENCH_PCTS; pct++)
+			seq_printf(s, " %10llu", div_u64(b->ns[row][pct], NSEC_PER_USEC));
+		seq_putc(s, '\n');
+	}
+
+	mutex_unlock(&data->lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bench_results);
+
+int yildun_bench_init(struct yildun_data *data)
+{
+	struct yildun_bench *b;
+
+	b = devm_kzalloc(data->dev, sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+
+	b->dir = debugfs_create_dir("yildun", NULL);
+	if (IS_ERR_OR_NULL(b->dir))
+		return -ENODEV;
+
+	debugfs_create_u32("chunk_size", 0600, b->dir, &b->chunk_size);
+	debugfs_create_u32("spi_speed_hz", 0600, b->dir, &b->spi_speed_hz);
+	debugfs_create_u32("transform", 0600, b->dir, &b->transform);
+	debugfs_create_file("run", 0200, b->dir, data, &bench_run_fops);
+	debugfs_create_file("results", 0400, b->dir, data, &bench_results_fops);
+
+	data->bench = b;
+	return 0;
+}
+
+void yildun_bench_exit(struct yildun_data *data)
+{
+	if (data->bench)
+		debugfs_remove_recursive(data->bench->dir);
+	data->bench = NULL;
+}
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ * Description of file:
+ *	Yildun generic backend, GPIO descriptors and regulators from DT
+ *
+ *	compatible = "flir,yildun-gpiod";
+ *	fpga-ce-gpios, fpga-conf-done-gpios, fpga-config-gpios,
+ *	fpga-status-gpios: active high, values as on the FPGA pins
+ *	vccint-supply, vccaux-supply, vccio-supply: optional
+ *	pinctrl "default"/"idle": optional, SPI/GPIO mux of the SPI pins
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "yildun_internal.h"
+#include <linux/gpio/consumer.h>
+#include <linux/regulator/consumer.h>
+#include <linux/platform_device.h>
+#include <linux/pinctrl/consumer.h>
+#include <linux/delay.h>
+
+static const char * const supply_names[] = { "vccint", "vccaux", "vccio" };
+
+struct gpiod_priv {
+	struct gpio_desc *ce;
+	struct gpio_desc *conf_done;
+	struct gpio_desc *config;
+	struct gpio_desc *status;
+	struct regulator_bulk_data supplies[ARRAY_SIZE(supply_names)];
+	bool powered;
+};
+
+static int SetupGpioAccessGpiod(PFVD_DEV_INFO pDev);
+static void CleanupGpioGpiod(PFVD_DEV_INFO pDev);
+static inline BOOL GetPinDoneGpiod(PFVD_DEV_INFO pDev);
+static inline BOOL GetPinStatusGpiod(PFVD_DEV_INFO pDev);
+static int CheckFPGAGpiod(PFVD_DEV_INFO pDev);
+static DWORD PutInProgrammingModeGpiod(PFVD_DEV_INFO);
+static void BSPFvdPowerDownGpiod(PFVD_DEV_INFO pDev);
+static void BSPFvdPowerUpGpiod(PFVD_DEV_INFO pDev);
+
+int SetupGpiod(PFVD_DEV_INFO pDev)
+{
+	pDev->priv = devm_kzalloc(pDev->dev, sizeof(struct gpiod_priv), GFP_KERNEL);
+	if (!pDev->priv)
+		return -ENOMEM;
+
+	pDev->pSetupGpioAccess = SetupGpioAccessGpiod;
+	pDev->pCleanupGpio = CleanupGpioGpiod;
+	pDev->pCheckFPGA = CheckFPGAGpiod;
+	pDev->pPutInProgrammingMode = PutInProgrammingModeGpiod;
+	pDev->pBSPFvdPowerUp = BSPFvdPowerUpGpiod;
+	pDev->pBSPFvdPowerDown = BSPFvdPowerDownGpiod;
+
+	pDev->iSpiBus = 1;		// Default, override with the "spi" child node
+	pDev->iSpiCountDivisor = 1;	// Count is no of bytes
+	return 0;
+}
+
+// GPIO expanders and PMICs may probe after us, only log real errors
+static int setup_error(struct device *dev, const char *what, int err)
+{
+	if (err != -EPROBE_DEFER)
+		dev_err(dev, "can't get %s (%d)\n", what, err);
+	return err;
+}
+
+int SetupGpioAccessGpiod(PFVD_DEV_INFO pDev)
+{
+	struct gpiod_priv *priv = pDev->priv;
+	struct device *dev = pDev->dev;
+	int i, ret;
+
+	/* FPGA control GPIO, unconfigured and disabled */
+	priv->ce = devm_gpiod_get(dev, "fpga-ce", GPIOD_OUT_HIGH);
+	if (IS_ERR(priv->ce))
+		return setup_error(dev, "gpio fpga-ce-gpios", PTR_ERR(priv->ce));
+
+	priv->config = devm_gpiod_get(dev, "fpga-config", GPIOD_OUT_LOW);
+	if (IS_ERR(priv->config))
+		return setup_error(dev, "gpio fpga-config-gpios", PTR_ERR(priv->config));
+
+	priv->conf_done = devm_gpiod_get(dev, "fpga-conf-done", GPIOD_IN);
+	if (IS_ERR(priv->conf_done))
+		return setup_error(dev, "gpio fpga-conf-done-gpios", PTR_ERR(priv->conf_done));
+
+	priv->status = devm_gpiod_get(dev, "fpga-status", GPIOD_IN);
+	if (IS_ERR(priv->status))
+		return setup_error(dev, "gpio fpga-status-gpios", PTR_ERR(priv->status));
+
+	/* FPGA regulators, dummies if not in DT */
+	for (i = 0; i < ARRAY_SIZE(supply_names); i++)
+		priv->supplies[i].supply = supply_names[i];
+	ret = devm_regulator_bulk_get(dev, ARRAY_SIZE(priv->supplies), priv->supplies);
+	if (ret)
+		return setup_error(dev, "regulators", ret);
+
+	/* Pinmux is optional */
+	pDev->pinctrl = devm_pinctrl_get(dev);
+	if (IS_ERR(pDev->pinctrl)) {
+		if (PTR_ERR(pDev->pinctrl) == -EPROBE_DEFER)
+			return -EPROBE_DEFER;
+		pDev->pinctrl = NULL;
+	} else {
+		pDev->pins_default = pinctrl_lookup_state(pDev->pinctrl, "default");
+		pDev->pins_sleep = pinctrl_lookup_state(pDev->pinctrl, "idle");
+		if (IS_ERR(pDev->pins_default) || IS_ERR(pDev->pins_sleep)) {
+			dev_err(dev, "pinctrl needs both default and idle states\n");
+			pDev->pinctrl = NULL;
+		} else {
+			pinctrl_select_state(pDev->pinctrl, pDev->pins_sleep);
+		}
+	}
+
+	return 0;
+}
+
+void CleanupGpioGpiod(PFVD_DEV_INFO pDev)
+{
+}
+
+static inline BOOL GetPinDoneGpiod(PFVD_DEV_INFO pDev)
+{
+	struct gpiod_priv *priv = pDev->priv;
+
+	return gpiod_get_value_cansleep(priv->conf_done) != 0;
+}
+
+static inline BOOL GetPinStatusGpiod(PFVD_DEV_INFO pDev)
+{
+	struct gpiod_priv *priv = pDev->priv;
+
+	return gpiod_get_value_cansleep(priv->status) != 0;
+}
+
+static int CheckFPGAGpiod(PFVD_DEV_INFO pDev)
+{
+	if (GetPinDoneGpiod(pDev))
+		return 0;
+
+	if (GetPinStatusGpiod(pDev))
+		return -ERROR_NO_CONFIG_DONE;
+
+	return -ERROR_NO_INIT_OK;
+}
+
+DWORD PutInProgrammingModeGpiod(PFVD_DEV_INFO pDev)
+{
+	struct gpiod_priv *priv = pDev->priv;
+	int tmo = 10;
+
+	// Set idle state (probably already done)
+	gpiod_set_value_cansleep(priv->config, 1);
+	usleep_range(1000, 2000);
+
+	// Activate programming (CONFIG  LOW)
+	gpiod_set_value_cansleep(priv->config, 0);
+	usleep_range(1000, 2000);
+
+	// Verify status
+	if (GetPinStatusGpiod(pDev)) {
+		dev_err(pDev->dev, "FPGA: Status not initially low\n");
+		return 0;
+	}
+
+	if (GetPinDoneGpiod(pDev)) {
+		dev_err(pDev->dev, "FPGA: Conf_Done not initially low\n");
+		return 0;
+	}
+	// Release config
+	gpiod_set_value_cansleep(priv->config, 1);
+	usleep_range(2000, 5000);
+
+	// Wait for POR to complete
+	while (tmo--) {
+		if (GetPinStatusGpiod(pDev))
+			break;
+		usleep_range(5000, 20000);
+	}
+
+	// Verify status
+	if (!GetPinStatusGpiod(pDev)) {
+		dev_err(pDev->dev, "FPGA: Status not high when config released\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * This function should apply power to the device.
+ *
+ *
+ * @param pDev
+ */
+void BSPFvdPowerUpGpiod(PFVD_DEV_INFO pDev)
+{
+	struct gpiod_priv *priv = pDev->priv;
+	int ret = 0;
+
+	// Set SPI as SPI
+	if (pDev->pinctrl)
+		ret = pinctrl_select_state(pDev->pinctrl, pDev->pins_default);
+	pDev->spi_pins_active = (ret == 0);
+
+	// Power ON
+	if (regulator_bulk_enable(ARRAY_SIZE(priv->supplies), priv->supplies))
+		dev_err(pDev->dev, "FPGA: Failed to enable regulators\n");
+	else
+		priv->powered = true;
+
+	usleep_range(10000, 20000);
+
+	// Release Config
+	gpiod_set_value_cansleep(priv->ce, 0);
+	gpiod_set_value_cansleep(priv->config, 1);
+
+	usleep_range(10000, 20000);
+}
+
+/**
+ * This function should suspend power to the device.
+ *
+ *
+ * @param pDev
+ */
+void BSPFvdPowerDownGpiod(PFVD_DEV_INFO pDev)
+{
+	struct gpiod_priv *priv = pDev->priv;
+
+	// Disable FPGA, unconfigure fpga
+	gpiod_set_value_cansleep(priv->ce, 1);
+	gpiod_set_value_cansleep(priv->config, 0);
+
+	// Switch off power
+	if (priv->powered)
+		regulator_bulk_disable(ARRAY_SIZE(priv->supplies), priv->supplies);
+	priv->powered = false;
+
+	// Set SPI as GPIO
+	pDev->spi_pins_active = false;
+	if (pDev->pinctrl)
+		pinctrl_select_state(pDev->pinctrl, pDev->pins_sleep);
+}
@@ -12,11 +12,56 @@
 #define __FVD_INTERNAL_H__
 
 #include <linux/proc_fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+
+struct spi_master;
+struct spi_device;
 
 #define FVD_MINOR_VERSION   0
 #define FVD_MAJOR_VERSION   1
 #define FVD_VERSION ((FVD_MAJOR_VERSION << 16) | FVD_MINOR_VERSION)
 
+// FPGA state from the backend's pCheckFPGA
+#define ERROR_NO_INIT_OK        10001
+#define ERROR_NO_CONFIG_DONE    10002
+
+#define YILDUN_HIST_BUCKETS 24
+
+// Aggregated load statistics, exported in sysfs
+struct yildun_stats {
+	atomic_long_t enables;			// Enable requests
+	atomic_long_t already_enabled;		// Requests with the FPGA already loaded
+	atomic_long_t loads;			// Requests that went to the FPGA
+	atomic_long_t load_ok;
+	atomic_long_t fail_init_ok;		// ERROR_NO_INIT_OK
+	atomic_long_t fail_config_done;		// ERROR_NO_CONFIG_DONE
+	atomic_long_t fail_spi;			// SPI write errors
+	atomic_long_t fail_other;
+	atomic_long_t prog_mode_retries;	// Second try in fpga_set_programming_mode()
+	atomic_long_t retries;			// Extra attempts in LoadFPGA()
+	// Enable time, bucket n counts [2^n, 2^(n+1)) us, the last is open ended
+	atomic_long_t enable_time_hist[YILDUN_HIST_BUCKETS];
+};
+
+// Timed phases of an enable, filled in by the enable path and LoadFPGA
+enum yildun_phase {
+	YILDUN_PHASE_POWER_UP,
+	YILDUN_PHASE_FIRMWARE,
+	YILDUN_PHASE_PROG_MODE,
+	YILDUN_PHASE_STREAM,
+	YILDUN_PHASE_CHECK,
+	YILDUN_PHASE_NUM,
+};
+
+// Transform applied to the bitstream before it is sent on SPI
+enum yildun_transform {
+	YILDUN_TRANSFORM_AUTO,		// As given by the FPGA header
+	YILDUN_TRANSFORM_BYTESWAP,
+	YILDUN_TRANSFORM_BITREVERSE,
+};
+
 // this structure keeps track of the device instance
 typedef struct __FVD_DEV_INFO {
 	// Linux driver variables
@@ -26,14 +71,18 @@ typedef struct __FVD_DEV_INFO {
 	/* char fpga[400];		// FPGA Header data buffer */
 
 	// CPU specific function pointers
-	BOOL(*pSetupGpioAccess) (struct __FVD_DEV_INFO * pDev);
+	int (*pSetupGpioAccess) (struct __FVD_DEV_INFO * pDev);	// 0 or negative errno
 	void (*pCleanupGpio) (struct __FVD_DEV_INFO * pDev);
-	BOOL(*pGetPinDone) (struct __FVD_DEV_INFO * pDev);
-	BOOL(*pGetPinStatus) (struct __FVD_DEV_INFO * pDev);
+	int (*pCheckFPGA) (struct __FVD_DEV_INFO * pDev);	// 0 or -ERROR_NO_*
 	BOOL(*pGetPinReady) (void);
 	DWORD(*pPutInProgrammingMode) (struct __FVD_DEV_INFO * pDev);
 	void (*pBSPFvdPowerUp) (struct __FVD_DEV_INFO * pDev);
 	void (*pBSPFvdPowerDown) (struct __FVD_DEV_INFO * pDev);
+	// Optional, replaces the SPI device for sending the bitstream
+	int (*pWriteData) (struct __FVD_DEV_INFO * pDev, const void *buf, size_t len);
+
+	// Backend private data
+	void *priv;
 
 	// CPU specific parameters
 	int iSpiBus;
@@ -59,6 +108,54 @@ typedef struct __FVD_DEV_INFO {
 	struct pinctrl_state    *pins_default;
 	struct pinctrl_state    *pins_sleep;
 
+	// SPI, created at probe and kept for the driver lifetime
+	struct spi_master *spi_master;
+	struct spi_device *spi_device;
+	bool spi_pins_active;	// Pinmux in "default" (SPI) state
+
+	// Load parameters, 0 selects the driver default
+	unsigned int chunk_size;
+	u32 spi_speed_hz;
+	enum yildun_transform transform;
+
+	// SPI bus sharing, see LoadFPGA()
+	unsigned int spi_burst_bytes;
+	unsigned int spi_burst_us;
+	bool spi_bus_exclusive;
+	u64 spi_max_latency_ns;	// Longest chunk/burst latency of the latest load
+
+	// Load verification and retry
+	u32 image_crc;		// CRC32 of the latest loaded bitstream
+	unsigned int load_retries;
+	unsigned int load_attempts;	// Attempts used by the latest load
+
+	struct yildun_stats stats;
+
+	// Duration of each phase of the latest enable
+	u64 phase_ns[YILDUN_PHASE_NUM];
+	bool benchmark;		// Debugfs benchmark running, see yildun_bench.c
+
 } FVD_DEV_INFO, *PFVD_DEV_INFO;
 
+struct yildun_bench;
+struct yildun_status;
+
+// Driver instance, one per "flir,yildun" platform device
+struct yildun_data {
+	FVD_DEV_INFO yildundev;
+	struct miscdevice miscdev;
+	struct device *dev;
+	struct mutex lock;	// Serializes enable/disable
+	int enabled;
+
+	// Published in the status page
+	u32 generation;
+	int last_result;
+	u64 last_enable_ns;
+	struct page *status_page;	// Mapped read-only by userspace, see yildun_mmap()
+	struct yildun_status *status;	// page_address(status_page)
+
+	struct yildun_bench *bench;
+};
+
 #endif				/* __FVD_INTERNAL_H__ */
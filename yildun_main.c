@@ -14,28 +14,28 @@
 #include "yildun_internal.h"
 #include <linux/platform_device.h>
 #include <linux/of.h>
+#include <linux/of_device.h>
 #include <yildundev.h>
 #include <linux/dma-mapping.h>
 #include <linux/miscdevice.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+
+#define YILDUN_LOAD_RETRIES 1	// Extra attempts at half the SPI clock
 
 static int init(struct device *dev);
 static void deinit(struct device *dev);
 static int yildun_probe(struct platform_device *pdev);
 static int yildun_remove(struct platform_device *pdev);
 static long ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
-
-struct yildun_data {
-	FVD_DEV_INFO yildundev;
-	struct miscdevice miscdev;
-	struct device *dev;
-	int enabled;
-};
+static int yildun_mmap(struct file *filep, struct vm_area_struct *vma);
 
 static const struct file_operations yildun_misc_fops = {
 	.owner = THIS_MODULE,
 	.unlocked_ioctl = ioctl,
 	/* .open = yildun_open, */
-	/* .mmap = yildun_mmap, */
+	.mmap = yildun_mmap,
 };
 
 /* static const struct dev_pm_ops yildun_pm_ops = { */
@@ -43,11 +43,176 @@ static const struct file_operations yildun_misc_fops = {
 /* 	.resume_early = yildun_resume, */
 /* }; */
 
+static const struct yildun_backend backend_mx6s = { "MX6S", SetupMX6S };
+static const struct yildun_backend backend_gpiod = { "gpiod", SetupGpiod };
+static const struct yildun_backend backend_sim = { "simulation", SetupSim };
+
 static const struct of_device_id yildun_match_table[] = {
-	{ .compatible = "flir,yildun", },
+	{ .compatible = "flir,yildun", .data = &backend_mx6s },
+	{ .compatible = "flir,yildun-gpiod", .data = &backend_gpiod },
+	{ .compatible = "flir,yildun-sim", .data = &backend_sim },
 	{}
 };
 
+/*
+ * sysfs attributes, load configuration
+ */
+#define YILDUN_ATTR_UINT(field)							\
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{										\
+	struct yildun_data *data = dev_get_drvdata(dev);			\
+										\
+	return sprintf(buf, "%u\n", data->yildundev.field);			\
+}										\
+static ssize_t field##_store(struct device *dev, struct device_attribute *attr, \
+			     const char *buf, size_t count)			\
+{										\
+	struct yildun_data *data = dev_get_drvdata(dev);			\
+	unsigned int val;							\
+	int ret = kstrtouint(buf, 0, &val);					\
+										\
+	if (ret)								\
+		return ret;							\
+	mutex_lock(&data->lock);						\
+	data->yildundev.field = val;						\
+	mutex_unlock(&data->lock);						\
+	return count;								\
+}										\
+static DEVICE_ATTR_RW(field)
+
+YILDUN_ATTR_UINT(spi_burst_bytes);
+YILDUN_ATTR_UINT(spi_burst_us);
+YILDUN_ATTR_UINT(load_retries);
+
+static ssize_t spi_bus_exclusive_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct yildun_data *data = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", data->yildundev.spi_bus_exclusive);
+}
+
+static ssize_t spi_bus_exclusive_store(struct device *dev, struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct yildun_data *data = dev_get_drvdata(dev);
+	bool val;
+	int ret = kstrtobool(buf, &val);
+
+	if (ret)
+		return ret;
+	mutex_lock(&data->lock);
+	data->yildundev.spi_bus_exclusive = val;
+	mutex_unlock(&data->lock);
+	return count;
+}
+static DEVICE_ATTR_RW(spi_bus_exclusive);
+
+static ssize_t spi_max_chunk_latency_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct yildun_data *data = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", div_u64(data->yildundev.spi_max_latency_ns, NSEC_PER_USEC));
+}
+static DEVICE_ATTR_RO(spi_max_chunk_latency_us);
+
+static struct attribute *yildun_attrs[] = {
+	&dev_attr_spi_burst_bytes.attr,
+	&dev_attr_spi_burst_us.attr,
+	&dev_attr_spi_bus_exclusive.attr,
+	&dev_attr_spi_max_chunk_latency_us.attr,
+	&dev_attr_load_retries.attr,
+	NULL,
+};
+
+static const struct attribute_group yildun_group = {
+	.attrs = yildun_attrs,
+};
+
+/*
+ * sysfs attributes, load statistics in stats/
+ */
+#define YILDUN_ATTR_STAT(field)							\
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{										\
+	struct yildun_data *data = dev_get_drvdata(dev);			\
+										\
+	return sprintf(buf, "%ld\n", atomic_long_read(&data->yildundev.stats.field)); \
+}										\
+static DEVICE_ATTR_RO(field)
+
+YILDUN_ATTR_STAT(enables);
+YILDUN_ATTR_STAT(already_enabled);
+YILDUN_ATTR_STAT(loads);
+YILDUN_ATTR_STAT(load_ok);
+YILDUN_ATTR_STAT(fail_init_ok);
+YILDUN_ATTR_STAT(fail_config_done);
+YILDUN_ATTR_STAT(fail_spi);
+YILDUN_ATTR_STAT(fail_other);
+YILDUN_ATTR_STAT(prog_mode_retries);
+YILDUN_ATTR_STAT(retries);
+
+// One line per bucket: lower bound in us and count
+static ssize_t enable_time_hist_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct yildun_data *data = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < YILDUN_HIST_BUCKETS; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%lu %ld\n", i ? 1UL << i : 0UL,
+				 atomic_long_read(&data->yildundev.stats.enable_time_hist[i]));
+	return len;
+}
+static DEVICE_ATTR_RO(enable_time_hist);
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct yildun_data *data = dev_get_drvdata(dev);
+	struct yildun_stats *st = &data->yildundev.stats;
+	atomic_long_t *p;
+	bool val;
+	int ret = kstrtobool(buf, &val);
+
+	if (ret)
+		return ret;
+	if (!val)
+		return count;
+
+	// All members are atomic_long_t
+	for (p = (atomic_long_t *)st; p < (atomic_long_t *)(st + 1); p++)
+		atomic_long_set(p, 0);
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *yildun_stats_attrs[] = {
+	&dev_attr_enables.attr,
+	&dev_attr_already_enabled.attr,
+	&dev_attr_loads.attr,
+	&dev_attr_load_ok.attr,
+	&dev_attr_fail_init_ok.attr,
+	&dev_attr_fail_config_done.attr,
+	&dev_attr_fail_spi.attr,
+	&dev_attr_fail_other.attr,
+	&dev_attr_prog_mode_retries.attr,
+	&dev_attr_retries.attr,
+	&dev_attr_enable_time_hist.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group yildun_stats_group = {
+	.name = "stats",
+	.attrs = yildun_stats_attrs,
+};
+
+static const struct attribute_group *yildun_groups[] = {
+	&yildun_group,
+	&yildun_stats_group,
+	NULL,
+};
+
 static struct platform_driver yildun_driver = {
 	.probe = yildun_probe,
 	.remove = yildun_remove,
@@ -55,6 +220,7 @@ static struct platform_driver yildun_driver = {
 		.of_match_table	= yildun_match_table,
 		.name = "yildun-misc-driver",
 		.owner = THIS_MODULE,
+		.dev_groups = yildun_groups,
 		/* .pm = &yildun_pm_ops, */
 	},
 };
@@ -70,6 +236,7 @@ static struct platform_driver yildun_driver = {
 static int init(struct device *dev)
 {
 	struct yildun_data *data = dev_get_drvdata(dev);
+	const struct yildun_backend *backend;
 	int retval = -1;
 
 	dev_info(dev, "Yildun Init\n");
@@ -82,26 +249,45 @@ static int init(struct device *dev)
 	*dev->dma_mask = DMA_BIT_MASK(32);
 	dev->coherent_dma_mask = DMA_BIT_MASK(32);
 
-	retval = SetupMX6S(&data->yildundev);
+	data->yildundev.load_retries = YILDUN_LOAD_RETRIES;
+
+	backend = of_device_get_match_data(dev);
+	if (!backend)
+		backend = &backend_mx6s;
+
+	retval = backend->setup(&data->yildundev);
 	if (retval) {
-		dev_err(dev, "Error initializing MX6S for Yildun\n");
+		dev_err(dev, "Error initializing %s for Yildun\n", backend->name);
 		return retval;
 	}
 
 	if (!data->yildundev.pSetupGpioAccess) {
 		dev_err(dev, "Error creating Yildun class\n");
+		retval = -ENODEV;
 		goto OUT_CLASSCREATE;
 	}
 
-	if (!data->yildundev.pSetupGpioAccess(&data->yildundev)) {
-		dev_err(dev, "Error setting up GPIO\n");
+	retval = data->yildundev.pSetupGpioAccess(&data->yildundev);
+	if (retval) {
+		if (retval != -EPROBE_DEFER)
+			dev_err(dev, "Error setting up GPIO\n");
+		goto OUT_DEVICECREATE;
+	}
+
+	retval = fpga_spi_setup(&data->yildundev);
+	if (retval) {
+		if (retval != -EPROBE_DEFER)
+			dev_err(dev, "Error setting up SPI\n");
 		goto OUT_DEVICECREATE;
 	}
 
 	return 0;
 
 OUT_DEVICECREATE:
+	// Still unpowered, nothing more to undo
 	data->yildundev.pCleanupGpio(&data->yildundev);
+	return retval;
+
 OUT_CLASSCREATE:
 	data->yildundev.pBSPFvdPowerDown(&data->yildundev);
 	return retval;
@@ -114,9 +300,16 @@ OUT_CLASSCREATE:
 static void deinit(struct device *dev)
 {
 	struct yildun_data *data = dev_get_drvdata(dev);
+
+	fpga_spi_release(&data->yildundev);
 	data->yildundev.pCleanupGpio(&data->yildundev);
 }
 
+static void status_page_put(void *page)
+{
+	put_page(page);
+}
+
 static int yildun_probe(struct platform_device *pdev)
 {
 	int ret;
@@ -127,6 +320,17 @@ static int yildun_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	platform_set_drvdata(pdev, data);
+	mutex_init(&data->lock);
+
+	// Refcounted, a mapping keeps the page alive after remove
+	data->status_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!data->status_page)
+		return -ENOMEM;
+	ret = devm_add_action_or_reset(dev, status_page_put, data->status_page);
+	if (ret)
+		return ret;
+	data->status = page_address(data->status_page);
+	data->status->version = YILDUN_STATUS_VERSION;
 
 	data->yildundev.dev = dev;
 	data->dev = dev;
@@ -135,14 +339,22 @@ static int yildun_probe(struct platform_device *pdev)
 	data->miscdev.fops = &yildun_misc_fops;
 	data->miscdev.parent = dev;
 
+	// Backend and SPI first, /dev/yildun only appears once it is usable
+	ret = init(dev);
+	if (ret)
+		return ret;
+
 	ret = misc_register(&data->miscdev);
 	if (ret) {
 		dev_err(dev, "Failed to register miscdev for Yildun driver\n");
-		//goto ERROR_MISC_REGISTER;
-		//TODO: Fail!!
+		deinit(dev);
+		return ret;
 	}
 
-	return init(dev);
+	if (yildun_bench_init(data))
+		dev_warn(dev, "Failed to create debugfs entries\n");
+
+	return 0;
 }
 
 static int yildun_remove(struct platform_device *pdev)
@@ -150,11 +362,167 @@ static int yildun_remove(struct platform_device *pdev)
 	struct yildun_data *data = platform_get_drvdata(pdev);
 	struct device *dev = &pdev->dev;
 
-	deinit(dev);
+	yildun_bench_exit(data);
 	misc_deregister(&data->miscdev);
+	deinit(dev);
 	return 0;
 }
 
+/**
+ * status_publish
+ *
+ * Copy the current state to the status page, seqcount style.
+ * Caller holds data->lock.
+ *
+ * @param data
+ */
+static void status_publish(struct yildun_data *data)
+{
+	struct yildun_status *st = data->status;
+	u32 seq = st->seq;
+
+	// Readers spin while seq is odd, so do not get preempted in between
+	preempt_disable();
+	WRITE_ONCE(st->seq, seq + 1);
+	smp_wmb();
+
+	WRITE_ONCE(st->enabled, data->enabled);
+	WRITE_ONCE(st->generation, data->generation);
+	WRITE_ONCE(st->last_result, data->last_result);
+	WRITE_ONCE(st->image_crc, data->yildundev.image_crc);
+	WRITE_ONCE(st->last_enable_ns, data->last_enable_ns);
+
+	smp_wmb();
+	WRITE_ONCE(st->seq, seq + 2);
+	preempt_enable();
+}
+
+// Histogram bucket for an enable time, log2 of microseconds
+static inline int hist_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return us ? min(ilog2(us), YILDUN_HIST_BUCKETS - 1) : 0;
+}
+
+/**
+ * status_read
+ *
+ * Copy the status page without taking data->lock, which is held for a
+ * whole load. Same protocol as documented for userspace in yildundev.h.
+ *
+ * @param data
+ * @param st
+ */
+static void status_read(struct yildun_data *data, struct yildun_status *st)
+{
+	const struct yildun_status *page = data->status;
+	u32 seq;
+
+	do {
+		while ((seq = READ_ONCE(page->seq)) & 1)
+			cpu_relax();
+		smp_rmb();
+		memcpy(st, page, sizeof(*st));
+		smp_rmb();
+	} while (READ_ONCE(page->seq) != seq);
+}
+
+/**
+ * yildun_enable
+ *
+ * Power up and load the FPGA unless already enabled.
+ * Caller holds data->lock.
+ *
+ * @param data
+ *
+ * @return 0 on success
+ *      negative on error
+ */
+int yildun_enable(struct yildun_data *data)
+{
+	struct yildun_stats *st = &data->yildundev.stats;
+	bool counted = !data->yildundev.benchmark;
+	ktime_t t;
+	int ret;
+
+	if (counted)
+		atomic_long_inc(&st->enables);
+	if (data->enabled) {
+		if (counted)
+			atomic_long_inc(&st->already_enabled);
+		return 0;
+	}
+
+	t = ktime_get();
+	data->yildundev.pBSPFvdPowerUp(&data->yildundev);
+	data->yildundev.phase_ns[YILDUN_PHASE_POWER_UP] = ktime_to_ns(ktime_sub(ktime_get(), t));
+
+	ret = LoadFPGA(&data->yildundev);
+	if (ret) {
+		data->yildundev.pBSPFvdPowerDown(&data->yildundev);
+	} else {
+		data->enabled = TRUE;
+		if (counted)
+			data->generation++;
+	}
+
+	// Benchmark cycles are kept out of the statistics and the status page
+	if (counted) {
+		data->last_result = ret;
+		data->last_enable_ns = ktime_to_ns(ktime_sub(ktime_get(), t));
+		atomic_long_inc(&st->enable_time_hist[hist_bucket(data->last_enable_ns)]);
+		status_publish(data);
+	}
+	return ret;
+}
+
+/**
+ * yildun_disable
+ *
+ * Power down the FPGA if enabled.
+ * Caller holds data->lock.
+ *
+ * @param data
+ */
+void yildun_disable(struct yildun_data *data)
+{
+	if (!data->enabled)
+		return;
+
+	data->yildundev.pBSPFvdPowerDown(&data->yildundev);
+	data->enabled = FALSE;
+	if (!data->yildundev.benchmark)
+		status_publish(data);
+}
+
+/**
+ * yildun_mmap
+ *
+ * Map the status page read-only.
+ *
+ * @param filep
+ * @param vma
+ *
+ * @return 0 on success
+ *      negative on error
+ */
+static int yildun_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct yildun_data *data = container_of(filep->private_data, struct yildun_data, miscdev);
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	// Takes a page reference, released when the mapping goes away
+	return vm_insert_page(vma, vma->vm_start, data->status_page);
+}
+
 /**
  * Yildun_IOControl
  *
@@ -172,26 +540,38 @@ static long ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 	switch (cmd) {
 	case IOCTL_YILDUN_ENABLE:
 		dev_dbg(data->dev, "IOCTL_YILDUN_ENABLE\n");
-		if (!data->enabled) {
-			data->yildundev.pBSPFvdPowerUp(&data->yildundev);
-			ret = LoadFPGA(&data->yildundev);
-			if (ret) {
-				data->yildundev.pBSPFvdPowerDown(&data->yildundev);
-				dev_err(data->dev, "Enable Yildun FPGA (IOCTL_YILDUN_ENABLE) failed: %d\n", ret);
-			} else {
-				data->enabled = TRUE;
-			}
-		}
+		ret = mutex_lock_interruptible(&data->lock);
+		if (ret)
+			break;
+		// The debugfs benchmark owns the FPGA until it is done
+		if (data->yildundev.benchmark)
+			ret = -EBUSY;
+		else
+			ret = yildun_enable(data);
+		mutex_unlock(&data->lock);
+		if (ret)
+			dev_err(data->dev, "Enable Yildun FPGA (IOCTL_YILDUN_ENABLE) failed: %d\n", ret);
 		break;
 
 	case IOCTL_YILDUN_DISABLE:
 		dev_dbg(data->dev, "IOCTL_YILDUN_DISABLE\n");
-		if (data->enabled) {
-			data->yildundev.pBSPFvdPowerDown(&data->yildundev);
-			data->enabled = FALSE;
-		}
+		ret = mutex_lock_interruptible(&data->lock);
+		if (ret)
+			break;
+		yildun_disable(data);
+		mutex_unlock(&data->lock);
 		break;
 
+	case IOCTL_YILDUN_GET_STATUS:
+	{
+		struct yildun_status st;
+
+		status_read(data, &st);
+		if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+			ret = -EFAULT;
+		break;
+	}
+
 	default:
 		dev_dbg(data->dev, "Yildun Ioctl %X Not supported\n", cmd);
 		ret = -ERROR_NOT_SUPPORTED;
@@ -8,10 +8,11 @@
 #include <linux/platform_device.h>
 #include <linux/pinctrl/consumer.h>
 
-static BOOL SetupGpioAccessMX6S(PFVD_DEV_INFO pDev);
+static int SetupGpioAccessMX6S(PFVD_DEV_INFO pDev);
 static void CleanupGpioMX6S(PFVD_DEV_INFO pDev);
-static BOOL GetPinDoneMX6S(PFVD_DEV_INFO pDev);
-static BOOL GetPinStatusMX6S(PFVD_DEV_INFO pDev);
+static inline BOOL GetPinDoneMX6S(PFVD_DEV_INFO pDev);
+static inline BOOL GetPinStatusMX6S(PFVD_DEV_INFO pDev);
+static int CheckFPGAMX6S(PFVD_DEV_INFO pDev);
 static DWORD PutInProgrammingModeMX6S(PFVD_DEV_INFO);
 static void BSPFvdPowerDownMX6S(PFVD_DEV_INFO pDev);
 static void BSPFvdPowerUpMX6S(PFVD_DEV_INFO pDev);
@@ -20,8 +21,7 @@ int SetupMX6S(PFVD_DEV_INFO pDev)
 {
 	pDev->pSetupGpioAccess = SetupGpioAccessMX6S;
 	pDev->pCleanupGpio = CleanupGpioMX6S;
-	pDev->pGetPinDone = GetPinDoneMX6S;
-	pDev->pGetPinStatus = GetPinStatusMX6S;
+	pDev->pCheckFPGA = CheckFPGAMX6S;
 	pDev->pPutInProgrammingMode = PutInProgrammingModeMX6S;
 	pDev->pBSPFvdPowerUp = BSPFvdPowerUpMX6S;
 	pDev->pBSPFvdPowerDown = BSPFvdPowerDownMX6S;
@@ -31,7 +31,7 @@ int SetupMX6S(PFVD_DEV_INFO pDev)
 	return 0;
 }
 
-BOOL SetupGpioAccessMX6S(PFVD_DEV_INFO pDev)
+int SetupGpioAccessMX6S(PFVD_DEV_INFO pDev)
 {
 	struct device *dev = pDev->dev;
 	int ret;
@@ -124,23 +124,34 @@ BOOL SetupGpioAccessMX6S(PFVD_DEV_INFO pDev)
 	if (devm_gpio_request_one(dev, pDev->spi_mosi_gpio, GPIOF_IN, "SPI2_MOSI"))
 		dev_err(pDev->dev, "SPI2_MOSI can not be requested\n");
 
-	return TRUE;
+	return 0;
 }
 
 void CleanupGpioMX6S(PFVD_DEV_INFO pDev)
 {
 }
 
-BOOL GetPinDoneMX6S(PFVD_DEV_INFO pDev)
+static inline BOOL GetPinDoneMX6S(PFVD_DEV_INFO pDev)
 {
 	return (gpio_get_value(pDev->fpga_conf_done) != 0);
 }
 
-BOOL GetPinStatusMX6S(PFVD_DEV_INFO pDev)
+static inline BOOL GetPinStatusMX6S(PFVD_DEV_INFO pDev)
 {
 	return (gpio_get_value(pDev->fpga_status) != 0);
 }
 
+static int CheckFPGAMX6S(PFVD_DEV_INFO pDev)
+{
+	if (GetPinDoneMX6S(pDev))
+		return 0;
+
+	if (GetPinStatusMX6S(pDev))
+		return -ERROR_NO_CONFIG_DONE;
+
+	return -ERROR_NO_INIT_OK;
+}
+
 DWORD PutInProgrammingModeMX6S(PFVD_DEV_INFO pDev)
 {
 	int tmo = 10;
@@ -198,6 +209,7 @@ void BSPFvdPowerUpMX6S(PFVD_DEV_INFO pDev)
 
 	// Set SPI as SPI
 	ret = pinctrl_select_state(pDev->pinctrl, pDev->pins_default);
+	pDev->spi_pins_active = (ret == 0);
 
 	// Power ON
 	ret |= regulator_enable(pDev->reg_3v15_fpga);
@@ -238,6 +250,7 @@ void BSPFvdPowerDownMX6S(PFVD_DEV_INFO pDev)
 	ret |= regulator_disable(pDev->reg_1v1_fpga);
 
 	// Set SPI as GPIO
+	pDev->spi_pins_active = false;
 	ret |= pinctrl_select_state(pDev->pinctrl, pDev->pins_sleep);
 
 	// Set SPI as input
@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/***********************************************************************
+ *
+ * Description of file:
+ *	Yildun simulation backend, no hardware access
+ *
+ *	compatible = "flir,yildun-sim";
+ *
+ *	The FPGA pins are modelled in memory and the bitstream is discarded
+ *	instead of sent on SPI, so the load path can be exercised on boards
+ *	without the FPGA. Failures can be injected with the sim_fail_writes
+ *	and sim_fail_loads module parameters.
+ *
+ * Copyright: FLIR Systems AB.  All rights reserved.
+ *
+ ***********************************************************************/
+
+#include "flir_kernel_os.h"
+#include "yildun_internal.h"
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/atomic.h>
+
+static atomic_t sim_fail_writes = ATOMIC_INIT(0);
+module_param_named(sim_fail_writes, sim_fail_writes.counter, int, 0644);
+MODULE_PARM_DESC(sim_fail_writes, "Simulation: number of upcoming bitstream writes to fail");
+
+static atomic_t sim_fail_loads = ATOMIC_INIT(0);
+module_param_named(sim_fail_loads, sim_fail_loads.counter, int, 0644);
+MODULE_PARM_DESC(sim_fail_loads, "Simulation: number of upcoming loads to leave CONF_DONE low");
+
+struct sim_priv {
+	bool powered;
+	bool config;
+	bool status;
+	bool conf_done;
+	bool fail_load;
+};
+
+static int SetupGpioAccessSim(PFVD_DEV_INFO pDev);
+static void CleanupGpioSim(PFVD_DEV_INFO pDev);
+static inline BOOL GetPinDoneSim(PFVD_DEV_INFO pDev);
+static inline BOOL GetPinStatusSim(PFVD_DEV_INFO pDev);
+static int CheckFPGASim(PFVD_DEV_INFO pDev);
+static DWORD PutInProgrammingModeSim(PFVD_DEV_INFO);
+static void BSPFvdPowerDownSim(PFVD_DEV_INFO pDev);
+static void BSPFvdPowerUpSim(PFVD_DEV_INFO pDev);
+static int WriteDataSim(PFVD_DEV_INFO pDev, const void *buf, size_t len);
+
+int SetupSim(PFVD_DEV_INFO pDev)
+{
+	pDev->priv = devm_kzalloc(pDev->dev, sizeof(struct sim_priv), GFP_KERNEL);
+	if (!pDev->priv)
+		return -ENOMEM;
+
+	pDev->pSetupGpioAccess = SetupGpioAccessSim;
+	pDev->pCleanupGpio = CleanupGpioSim;
+	pDev->pCheckFPGA = CheckFPGASim;
+	pDev->pPutInProgrammingMode = PutInProgrammingModeSim;
+	pDev->pBSPFvdPowerUp = BSPFvdPowerUpSim;
+	pDev->pBSPFvdPowerDown = BSPFvdPowerDownSim;
+	pDev->pWriteData = WriteDataSim;
+
+	pDev->iSpiBus = -1;		// No SPI
+	pDev->iSpiCountDivisor = 1;	// Count is no of bytes
+	return 0;
+}
+
+int SetupGpioAccessSim(PFVD_DEV_INFO pDev)
+{
+	dev_info(pDev->dev, "Yildun simulation, no hardware is accessed\n");
+	return 0;
+}
+
+void CleanupGpioSim(PFVD_DEV_INFO pDev)
+{
+}
+
+static inline BOOL GetPinDoneSim(PFVD_DEV_INFO pDev)
+{
+	struct sim_priv *priv = pDev->priv;
+
+	return priv->conf_done;
+}
+
+static inline BOOL GetPinStatusSim(PFVD_DEV_INFO pDev)
+{
+	struct sim_priv *priv = pDev->priv;
+
+	return priv->status;
+}
+
+static int CheckFPGASim(PFVD_DEV_INFO pDev)
+{
+	if (GetPinDoneSim(pDev))
+		return 0;
+
+	if (GetPinStatusSim(pDev))
+		return -ERROR_NO_CONFIG_DONE;
+
+	return -ERROR_NO_INIT_OK;
+}
+
+DWORD PutInProgrammingModeSim(PFVD_DEV_INFO pDev)
+{
+	struct sim_priv *priv = pDev->priv;
+
+	if (!priv->powered) {
+		dev_err(pDev->dev, "FPGA: Status not high when config released\n");
+		return 0;
+	}
+
+	// CONFIG pulsed low, FPGA cleared and waiting for data
+	priv->config = true;
+	priv->conf_done = false;
+	priv->status = true;
+	priv->fail_load = atomic_dec_if_positive(&sim_fail_loads) >= 0;
+
+	return 1;
+}
+
+static int WriteDataSim(PFVD_DEV_INFO pDev, const void *buf, size_t len)
+{
+	struct sim_priv *priv = pDev->priv;
+
+	if (atomic_dec_if_positive(&sim_fail_writes) >= 0)
+		return -EIO;
+
+	if (priv->powered && priv->config && !priv->fail_load)
+		priv->conf_done = true;
+
+	return 0;
+}
+
+void BSPFvdPowerUpSim(PFVD_DEV_INFO pDev)
+{
+	struct sim_priv *priv = pDev->priv;
+
+	priv->powered = true;
+	priv->config = true;
+	pDev->spi_pins_active = true;
+}
+
+void BSPFvdPowerDownSim(PFVD_DEV_INFO pDev)
+{
+	struct sim_priv *priv = pDev->priv;
+
+	priv->powered = false;
+	priv->config = false;
+	priv->status = false;
+	priv->conf_done = false;
+	pDev->spi_pins_active = false;
+}
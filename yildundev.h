@@ -1,6 +1,8 @@
 #ifndef YILDUNDEV_H
 #define YILDUNDEV_H
 
+#include <linux/types.h>
+
 #define YILDUN_IOCTL_W(code,type)   _IOW('y', code, type)
 #define YILDUN_IOCTL_R(code,type)   _IOR('y', code, type)
 #define YILDUN_IOCTL_WR(code,type)  _IOWR('y', code, type)
@@ -8,5 +10,26 @@
 
 #define IOCTL_YILDUN_ENABLE	YILDUN_IOCTL_NWR(1)
 #define IOCTL_YILDUN_DISABLE	YILDUN_IOCTL_NWR(2)
+#define IOCTL_YILDUN_GET_STATUS	YILDUN_IOCTL_R(3, struct yildun_status)
+
+#define YILDUN_STATUS_VERSION	1
+
+/*
+ * Device status, also available read-only by mmap of one page at offset 0
+ * of /dev/yildun. The driver updates it like a seqcount: seq is odd while
+ * an update is in progress. A reader loads seq, waits for it to be even,
+ * copies the fields and retries if seq has changed (with read barriers
+ * between the loads). Enable/disable cycles run by the debugfs benchmark
+ * are not published.
+ */
+struct yildun_status {
+	__u32 seq;
+	__u32 version;		// YILDUN_STATUS_VERSION
+	__u32 enabled;		// FPGA powered and loaded
+	__u32 generation;	// Incremented on every successful IOCTL_YILDUN_ENABLE load
+	__s32 last_result;	// Result of the latest enable, 0 or negative error
+	__u32 image_crc;	// CRC32 of the latest loaded bitstream
+	__u64 last_enable_ns;	// Duration of the latest enable
+};
 
 #endif